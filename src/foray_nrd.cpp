@@ -8,6 +8,13 @@ namespace foray::nrdd {
         Destroy();
         mContext            = context;
         mLibraryDescription = nrd::GetLibraryDesc();
+        mInitStart          = std::chrono::steady_clock::now();
+
+        mImageLookup[nrd::ResourceType::OUT_DIFF_RADIANCE_HITDIST] = config.PrimaryOutput;
+        mImageLookup[nrd::ResourceType::IN_NORMAL_ROUGHNESS]       = config.GBufferOutputs[(size_t)stages::GBufferStage::EOutput::Normal];
+        mImageLookup[nrd::ResourceType::IN_VIEWZ]                  = config.GBufferOutputs[(size_t)stages::GBufferStage::EOutput::LinearZ];
+        mImageLookup[nrd::ResourceType::IN_DIFF_RADIANCE_HITDIST]  = config.PrimaryInput;
+        mImageLookup[nrd::ResourceType::IN_MV]                     = config.GBufferOutputs[(size_t)stages::GBufferStage::EOutput::Motion];
 
         nrd::MethodDesc methods[] = {nrd::MethodDesc{.method = mActiveMethod, .fullResolutionWidth = 1280, .fullResolutionHeight = 720}};
 
@@ -21,19 +28,82 @@ namespace foray::nrdd {
         mDenoiserDescription = nrd::GetDenoiserDesc(*mDenoiser);
 
         // TODO: Evaluate and setup denoiser description
+        // Samplers go through the (not thread safe) context owned sampler collection, so they are always created on the calling thread
         InitSamplers();
+
+        if(mAsyncInit)
+        {
+            mInitFuture = std::async(std::launch::async, [this]() { InitDeviceResources(); });
+        }
+        else
+        {
+            InitDeviceResources();
+            mReady = true;
+        }
+    }
+
+    void NrdDenoiser::InitDeviceResources()
+    {
         InitPermanentImages();
         InitTransientImages();
         InitDescriptorPool();
         InitSubStages();
+        mTimeToReady = std::chrono::steady_clock::now() - mInitStart;
+    }
 
-        mImageLookup[nrd::ResourceType::OUT_DIFF_RADIANCE_HITDIST] = config.PrimaryOutput;
-        mImageLookup[nrd::ResourceType::IN_NORMAL_ROUGHNESS]       = config.GBufferOutputs[(size_t)stages::GBufferStage::EOutput::Normal];
-        mImageLookup[nrd::ResourceType::IN_VIEWZ]                  = config.GBufferOutputs[(size_t)stages::GBufferStage::EOutput::LinearZ];
-        mImageLookup[nrd::ResourceType::IN_DIFF_RADIANCE_HITDIST]  = config.PrimaryInput;
-        mImageLookup[nrd::ResourceType::IN_MV]                     = config.GBufferOutputs[(size_t)stages::GBufferStage::EOutput::Motion];
+    void NrdDenoiser::PollAsyncInit()
+    {
+        if(mReady || !mInitFuture.valid())
+        {
+            return;
+        }
+        if(mInitFuture.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            return;
+        }
+        mInitFuture.get();  // Rethrows exceptions from the worker thread
+        mReady = true;
+        logger()->info("NRD device resources ready after {:.1f}ms", mTimeToReady.count());
+    }
+
+    template <typename TStage>
+    bool NrdDenoiser::PollLazyStage(TStage& stage, LazyStage& state)
+    {
+        if(state.Ready)
+        {
+            return true;
+        }
+        if(!state.Started)
+        {
+            state.Started = true;
+            // Shader compilation goes through context owned collections, so it stays on the calling thread
+            stage.InitShader(this);
+            if(mAsyncInit)
+            {
+                state.Future = std::async(std::launch::async, [&stage]() { stage.Init(); });
+                return false;
+            }
+            stage.Init();
+            state.Ready = true;
+            return true;
+        }
+        if(state.Future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            return false;
+        }
+        state.Future.get();  // Rethrows exceptions from the worker thread
+        state.Ready = true;
+        return true;
+    }
 
-    }  // namespace foray::nrdd
+    void NrdDenoiser::ResetLazyStage(LazyStage& state)
+    {
+        if(state.Future.valid())
+        {
+            state.Future.wait();
+        }
+        state = {};
+    }
 
     void NrdDenoiser::InitSamplers()
     {
@@ -100,6 +170,34 @@ namespace foray::nrdd {
             mSamplers[i].Ref.Init(mContext->SamplerCol, samplerCi);
             mSamplers[i].RegIndex = desc.registerIndex;
         }
+
+        mImmutableSamplers.resize(mSamplers.size());
+        for(int32_t i = 0; i < mSamplers.size(); i++)
+        {
+            mImmutableSamplers[i] = mSamplers[i].Ref;
+        }
+
+        {  // Used by the reprojection stage
+            VkSamplerCreateInfo samplerCi{
+                .sType                   = VkStructureType::VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+                .magFilter               = VkFilter::VK_FILTER_LINEAR,
+                .minFilter               = VkFilter::VK_FILTER_LINEAR,
+                .mipmapMode              = VkSamplerMipmapMode::VK_SAMPLER_MIPMAP_MODE_NEAREST,
+                .addressModeU            = VkSamplerAddressMode::VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                .addressModeV            = VkSamplerAddressMode::VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                .addressModeW            = VkSamplerAddressMode::VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                .mipLodBias              = 0,
+                .anisotropyEnable        = VK_FALSE,
+                .maxAnisotropy           = 0,
+                .compareEnable           = VK_FALSE,
+                .compareOp               = {},
+                .minLod                  = 0,
+                .maxLod                  = VK_LOD_CLAMP_NONE,
+                .borderColor             = {},
+                .unnormalizedCoordinates = VK_FALSE,
+            };
+            mLinearClampSampler.Init(mContext->SamplerCol, samplerCi);
+        }
     }
     void NrdDenoiser::InitPermanentImages()
     {
@@ -271,9 +369,148 @@ namespace foray::nrdd {
             mSubStages[i] = std::make_unique<NrdSubStage>();
             mSubStages[i]->Init(this, desc, mDenoiserDescription.constantBufferDesc.maxDataSize);
         }
+        logger()->info("NRD: {} pipelines share {} layouts", mSubStages.size(), mLayoutCache.size());
+    }
+
+    NrdDenoiser::LayoutCacheEntry& NrdDenoiser::GetOrCreateLayout(const nrd::PipelineDesc& desc)
+    {
+        LayoutKey key{.HasConstantData = desc.hasConstantData};
+        for(int32_t i = 0; i < desc.descriptorRangeNum; i++)
+        {
+            const nrd::DescriptorRangeDesc& range = desc.descriptorRanges[i];
+            switch(range.descriptorType)
+            {
+                case nrd::DescriptorType::TEXTURE:
+                    key.TextureNum += range.descriptorNum;
+                    break;
+                case nrd::DescriptorType::STORAGE_TEXTURE:
+                    key.StorageTextureNum += range.descriptorNum;
+                    break;
+                default:
+                    Exception::Throw("Unhandled DescriptorType Enum Value");
+            }
+        }
+
+        std::unique_ptr<LayoutCacheEntry>& entry = mLayoutCache[key];
+        if(!!entry)
+        {
+            return *entry;
+        }
+        entry = std::make_unique<LayoutCacheEntry>();
+
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+
+        for(uint32_t i = 0; i < mImmutableSamplers.size(); i++)
+        {
+            bindings.push_back(VkDescriptorSetLayoutBinding{.binding            = BIND_OFFSET_SAMPLERS + i,
+                                                            .descriptorType     = VkDescriptorType::VK_DESCRIPTOR_TYPE_SAMPLER,
+                                                            .descriptorCount    = 1U,
+                                                            .stageFlags         = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT,
+                                                            .pImmutableSamplers = &mImmutableSamplers[i]});
+        }
+
+        if(key.HasConstantData)
+        {
+            bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = BIND_OFFSET_CONSTANTBUF,
+                                                            .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                                            .descriptorCount = 1U,
+                                                            .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
+        }
+
+        for(uint32_t i = 0; i < key.TextureNum; i++)
+        {
+            bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = BIND_OFFSET_TEXIMG + i,
+                                                            .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE,
+                                                            .descriptorCount = 1U,
+                                                            .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
+        }
+
+        for(uint32_t i = 0; i < key.StorageTextureNum; i++)
+        {
+            bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = BIND_OFFSET_STORAGEIMG + i,
+                                                            .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                                            .descriptorCount = 1U,
+                                                            .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
+        }
+
+        VkDescriptorSetLayoutCreateInfo layoutCi{.sType        = VkStructureType::VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                                                 .flags        = VkDescriptorSetLayoutCreateFlagBits::VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR,
+                                                 .bindingCount = (uint32_t)bindings.size(),
+                                                 .pBindings    = bindings.data()};
+
+        AssertVkResult(vkCreateDescriptorSetLayout(mContext->Device(), &layoutCi, nullptr, &entry->DescriptorSetLayout));
+
+        entry->PipelineLayout.AddDescriptorSetLayout(entry->DescriptorSetLayout);
+        entry->PipelineLayout.Build(mContext);
+
+        return *entry;
+    }
+    void NrdDenoiser::DestroyLayoutCache()
+    {
+        for(auto& [key, entry] : mLayoutCache)
+        {
+            entry->PipelineLayout.Destroy();
+            if(!!entry->DescriptorSetLayout)
+            {
+                vkDestroyDescriptorSetLayout(mContext->Device(), entry->DescriptorSetLayout, nullptr);
+            }
+        }
+        mLayoutCache.clear();
     }
 
     void NrdDenoiser::RecordFrame(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo)
+    {
+        PollAsyncInit();
+        if(!mReady)
+        {
+            RecordPassthrough(cmdBuffer, renderInfo);
+            return;
+        }
+
+        if(mBackgroundClassification && PollLazyStage(mTileClassifyStage, mTileClassifyStageInit))
+        {
+            UpdateDenoisingRange(renderInfo);
+        }
+
+        core::ManagedImage* motion = mImageLookup.at(nrd::ResourceType::IN_MV);
+
+        if(mFullPassInterval <= 1U || !PollLazyStage(mReprojectStage, mReprojectStageInit))
+        {
+            // Reprojection state goes stale while every frame is a full pass
+            if(mReprojectStageInit.Ready)
+            {
+                mReprojectStage.ResetHistory();
+            }
+            mFramesSinceFullPass  = 0U;
+            mLastFrameWasFullPass = true;
+            RecordFullPass(cmdBuffer, renderInfo, motion);
+            return;
+        }
+
+        mReprojectStage.ReadbackDisocclusion(renderInfo);
+
+        bool fullPass = !mReprojectStage.HasHistory() || mFramesSinceFullPass + 1U >= mFullPassInterval
+                        || mReprojectStage.GetDisoccludedFraction() > mDisocclusionFallbackThreshold;
+
+        if(!fullPass)
+        {
+            mReprojectStage.RecordReproject(cmdBuffer, renderInfo, mLastFrameWasFullPass, mDisocclusionDepthThreshold);
+            // Background goes straight from input to output, not through the warped history
+            RecordBackgroundClassification(cmdBuffer, renderInfo);
+            mFramesSinceFullPass++;
+            mLastFrameWasFullPass = false;
+            return;
+        }
+
+        // NRD history is as old as the last full pass, so IN_MV has to cover every frame since then
+        mReprojectStage.RecordAccumulate(cmdBuffer, renderInfo, mLastFrameWasFullPass);
+        RecordFullPass(cmdBuffer, renderInfo, mReprojectStage.GetAccumulatedMotion());
+        mReprojectStage.RecordCapture(cmdBuffer, renderInfo);
+        mFramesSinceFullPass  = 0U;
+        mLastFrameWasFullPass = true;
+    }
+
+    void NrdDenoiser::RecordFullPass(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, core::ManagedImage* motion)
     {
         if(mFirstFrameRendered)
         {
@@ -284,6 +521,9 @@ namespace foray::nrdd {
         }
         mFirstFrameRendered = true;
 
+        core::ManagedImage* gbufferMotion        = mImageLookup.at(nrd::ResourceType::IN_MV);
+        mImageLookup.at(nrd::ResourceType::IN_MV) = motion;
+
         const nrd::DispatchDesc* dispatchDescriptions = nullptr;
 
         uint32_t dispatchCount = 0;
@@ -299,8 +539,78 @@ namespace foray::nrdd {
             mSubStages[dispatchDesc.pipelineIndex]->RecordFrame(cmdBuffer, renderInfo, dispatchDesc);
         }
 
+        mImageLookup.at(nrd::ResourceType::IN_MV) = gbufferMotion;
+
+        // Runs after NRD, as NRD gives no guarantees about output pixels beyond the denoising range
+        RecordBackgroundClassification(cmdBuffer, renderInfo);
+
+        // NRD only sees full passes, so its frame index advances with them rather than with the application frame
+        mSettings.frameIndex++;
+
         // TODO: Transfer all permanent images to shader read only
     }
+    void NrdDenoiser::UpdateDenoisingRange(base::FrameRenderInfo& renderInfo)
+    {
+        if(!mTileClassifyStage.ReadbackResults(renderInfo))
+        {
+            return;
+        }
+        fp32 maxViewZ = mTileClassifyStage.GetMaxForegroundViewZ();
+        if(maxViewZ > 0.f)  // Keep the previous range if the frame contained only background
+        {
+            mSettings.denoisingRange = maxViewZ * mDenoisingRangeMargin;
+        }
+    }
+    void NrdDenoiser::RecordBackgroundClassification(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo)
+    {
+        if(mBackgroundClassification && mTileClassifyStageInit.Ready)
+        {
+            mTileClassifyStage.RecordFrame(cmdBuffer, renderInfo, mSettings.denoisingRange, mBackgroundViewZ);
+        }
+    }
+    void NrdDenoiser::RecordPassthrough(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo)
+    {
+        core::ManagedImage* input  = mImageLookup.at(nrd::ResourceType::IN_DIFF_RADIANCE_HITDIST);
+        core::ManagedImage* output = mImageLookup.at(nrd::ResourceType::OUT_DIFF_RADIANCE_HITDIST);
+
+        {  // Pipeline Barrier
+            std::array<VkImageMemoryBarrier2, 2> imageBarriers;
+
+            core::ImageLayoutCache::Barrier2 srcBarrier{.SrcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                                        .SrcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                        .DstStageMask  = VK_PIPELINE_STAGE_2_BLIT_BIT,
+                                                        .DstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT,
+                                                        .NewLayout     = VkImageLayout::VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL};
+            imageBarriers[0] = renderInfo.GetImageLayoutCache().MakeBarrier(input->GetImage(), srcBarrier);
+
+            core::ImageLayoutCache::Barrier2 dstBarrier{.SrcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                                        .SrcAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                        .DstStageMask  = VK_PIPELINE_STAGE_2_BLIT_BIT,
+                                                        .DstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                                                        .NewLayout     = VkImageLayout::VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL};
+            imageBarriers[1] = renderInfo.GetImageLayoutCache().MakeBarrier(output->GetImage(), dstBarrier);
+
+            VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                     .imageMemoryBarrierCount = (uint32_t)imageBarriers.size(),
+                                     .pImageMemoryBarriers    = imageBarriers.data()};
+
+            vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+        }
+        {  // Blit (handles differing formats between input and output)
+            VkExtent3D srcExtent = input->GetExtent3D();
+            VkExtent3D dstExtent = output->GetExtent3D();
+
+            VkImageBlit region{
+                .srcSubresource = VkImageSubresourceLayers{.aspectMask = VkImageAspectFlagBits::VK_IMAGE_ASPECT_COLOR_BIT, .mipLevel = 0, .baseArrayLayer = 0, .layerCount = 1},
+                .srcOffsets     = {VkOffset3D{}, VkOffset3D{(int32_t)srcExtent.width, (int32_t)srcExtent.height, 1}},
+                .dstSubresource = VkImageSubresourceLayers{.aspectMask = VkImageAspectFlagBits::VK_IMAGE_ASPECT_COLOR_BIT, .mipLevel = 0, .baseArrayLayer = 0, .layerCount = 1},
+                .dstOffsets     = {VkOffset3D{}, VkOffset3D{(int32_t)dstExtent.width, (int32_t)dstExtent.height, 1}},
+            };
+
+            vkCmdBlitImage(cmdBuffer, input->GetImage(), VkImageLayout::VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, output->GetImage(),
+                           VkImageLayout::VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1U, &region, VkFilter::VK_FILTER_NEAREST);
+        }
+    }
     VkFormat NrdDenoiser::ResolveImage(nrd::ResourceType type, uint32_t index, VkImage& outImage, VkImageView& outView)
     {
         switch(type)
@@ -324,7 +634,7 @@ namespace foray::nrdd {
                 {
                     FORAY_THROWFMT("Missing Resource {}!", NAMEOF_ENUM(type))
                 }
-                core::ManagedImage& image = *mImageLookup[type];
+                core::ManagedImage& image = *mImageLookup.at(type);
                 outImage                  = image.GetImage();
                 outView                   = image.GetImageView();
                 return image.GetFormat();
@@ -342,13 +652,28 @@ namespace foray::nrdd {
     void NrdDenoiser::Resize(const VkExtent2D& size) {}
     void NrdDenoiser::Destroy()
     {
+        if(mInitFuture.valid())
+        {
+            // Let a pending async init finish before tearing down the resources it writes to
+            mInitFuture.wait();
+            mInitFuture = {};
+        }
+        mReady       = false;
+        mTimeToReady = {};
         if(!!mDenoiser)
         {
             nrd::DestroyDenoiser(*mDenoiser);
             mDenoiser = nullptr;
         }
+        ResetLazyStage(mReprojectStageInit);
+        mReprojectStage.Destroy();
+        ResetLazyStage(mTileClassifyStageInit);
+        mTileClassifyStage.Destroy();
         mSubStages.clear();
+        DestroyLayoutCache();
+        mImmutableSamplers.clear();
         mSamplers.clear();
+        mLinearClampSampler.Destroy();
         mPermanentImages.clear();
         mTransientImages.clear();
         if(!!mDescriptorPool)
@@ -356,6 +681,9 @@ namespace foray::nrdd {
             vkDestroyDescriptorPool(mContext->Device(), mDescriptorPool, nullptr);
             mDescriptorPool = nullptr;
         }
-        mFirstFrameRendered = false;
+        mFirstFrameRendered   = false;
+        mFramesSinceFullPass  = 0U;
+        mLastFrameWasFullPass = true;
+        mSettings.frameIndex  = 0U;
     }
 }  // namespace foray::nrdd
@@ -1,11 +1,19 @@
 #pragma once
+#include "foray_nrd_reproject.hpp"
 #include "foray_nrd_substage.hpp"
+#include "foray_nrd_tileclassify.hpp"
 #include "include_ndr.hpp"
 #include <core/foray_managedimage.hpp>
 #include <core/foray_samplercollection.hpp>
 #include <stages/foray_denoiserstage.hpp>
 #include <util/foray_dualbuffer.hpp>
 #include <util/foray_historyimage.hpp>
+#include <util/foray_pipelinelayout.hpp>
+#include <atomic>
+#include <chrono>
+#include <compare>
+#include <future>
+#include <map>
 
 namespace foray::nrdd {
 
@@ -13,6 +21,8 @@ namespace foray::nrdd {
     class NrdDenoiser : public stages::DenoiserStage
     {
         friend NrdSubStage;
+        friend NrdReprojectStage;
+        friend NrdTileClassifyStage;
 
       public:
         inline static constexpr uint32_t BIND_OFFSET_SAMPLERS    = 100U;
@@ -30,15 +40,127 @@ namespace foray::nrdd {
 
         virtual void Destroy() override;
 
+        /// @brief Destroy() joins a pending async init before the members it writes to are destroyed
+        inline virtual ~NrdDenoiser() { Destroy(); }
+
         virtual VkFormat ResolveImage(nrd::ResourceType type, uint32_t index, VkImage& outImage, VkImageView& outView);
 
+        /// @brief If enabled, Init() returns after creating the NRD instance and builds image pools and pipelines on a worker thread.
+        /// Until that completes, RecordFrame() copies PrimaryInput to PrimaryOutput (both images need transfer usage).
+        inline NrdDenoiser& SetAsyncInit(bool asyncInit)
+        {
+            mAsyncInit = asyncInit;
+            return *this;
+        }
+        inline bool GetAsyncInit() const { return mAsyncInit; }
+
+        /// @brief True once RecordFrame() runs the full NRD dispatch list
+        inline bool IsReady() const { return mReady; }
+        /// @brief Time from Init() until all device resources were built. Zero while not ready.
+        inline std::chrono::duration<double, std::milli> GetTimeToReady() const { return mReady ? mTimeToReady : std::chrono::duration<double, std::milli>::zero(); }
+
+        /// @brief Run the full NRD dispatch list only every Nth frame. Frames in between reproject the last denoised output along IN_MV. 1 disables reduced-rate denoising.
+        /// The reprojection stage is built on the first frame with an interval above 1, full passes run until it is ready.
+        inline NrdDenoiser& SetFullPassInterval(uint32_t interval)
+        {
+            mFullPassInterval = std::max(interval, 1U);
+            return *this;
+        }
+        inline uint32_t GetFullPassInterval() const { return mFullPassInterval; }
+        /// @brief Fraction of disoccluded pixels in a reprojected frame above which a full pass is forced early. The count is read back INFLIGHT_FRAME_COUNT frames
+        /// after the reprojection, and counts still in flight at a full pass are discarded, so this only has an effect with a full pass interval above INFLIGHT_FRAME_COUNT + 1.
+        inline NrdDenoiser& SetDisocclusionFallbackThreshold(fp32 fraction)
+        {
+            mDisocclusionFallbackThreshold = fraction;
+            return *this;
+        }
+        inline fp32 GetDisocclusionFallbackThreshold() const { return mDisocclusionFallbackThreshold; }
+        /// @brief Relative view depth difference above which a reprojected pixel counts as disoccluded
+        inline NrdDenoiser& SetDisocclusionDepthThreshold(fp32 relativeDepth)
+        {
+            mDisocclusionDepthThreshold = relativeDepth;
+            return *this;
+        }
+        inline fp32 GetDisocclusionDepthThreshold() const { return mDisocclusionDepthThreshold; }
+
+        /// @brief View depth beyond which NRD skips pixels (CommonSettings::denoisingRange). While background classification is enabled, it is overwritten every frame
+        /// from the scene depth measured INFLIGHT_FRAME_COUNT frames earlier.
+        inline NrdDenoiser& SetDenoisingRange(fp32 range)
+        {
+            mSettings.denoisingRange = range;
+            return *this;
+        }
+        inline fp32 GetDenoisingRange() const { return mSettings.denoisingRange; }
+        /// @brief If enabled, a tile classification pass after NRD copies background pixels from PrimaryInput to PrimaryOutput,
+        /// and the denoising range follows the maximum foreground view depth of the scene. The pass is built on the first frame it is enabled for.
+        inline NrdDenoiser& SetBackgroundClassification(bool enabled)
+        {
+            mBackgroundClassification = enabled;
+            return *this;
+        }
+        inline bool GetBackgroundClassification() const { return mBackgroundClassification; }
+        /// @brief View depth at and beyond which pixels count as sky and are excluded from the scene depth range
+        inline NrdDenoiser& SetBackgroundViewZ(fp32 viewZ)
+        {
+            mBackgroundViewZ = viewZ;
+            return *this;
+        }
+        inline fp32 GetBackgroundViewZ() const { return mBackgroundViewZ; }
+        /// @brief Fraction of screen tiles skipped as background in the last completed classified frame
+        inline fp32 GetBackgroundTileFraction() const { return mTileClassifyStage.GetBackgroundTileFraction(); }
+
       protected:
+        void InitDeviceResources();
         void InitSamplers();
         void InitPermanentImages();
         void InitTransientImages();
         void InitDescriptorPool();
         void InitSubStages();
 
+        /// @brief Binding signature of a NRD pipeline. Static samplers are shared by all pipelines, and texture and storage bindings are assigned sequentially,
+        /// so the counts fully determine the descriptor set layout.
+        struct LayoutKey
+        {
+            bool     HasConstantData   = false;
+            uint32_t TextureNum        = 0;
+            uint32_t StorageTextureNum = 0;
+
+            auto operator<=>(const LayoutKey&) const = default;
+        };
+        struct LayoutCacheEntry
+        {
+            VkDescriptorSetLayout DescriptorSetLayout = nullptr;
+            util::PipelineLayout  PipelineLayout;
+        };
+
+        /// @brief Returns the layouts for the binding signature of desc, creating them on first use
+        LayoutCacheEntry& GetOrCreateLayout(const nrd::PipelineDesc& desc);
+        void              DestroyLayoutCache();
+
+        /// @brief Checks for completion of the async init at a frame boundary
+        void PollAsyncInit();
+        /// @brief Blits PrimaryInput to PrimaryOutput, used while device resources are still being built
+        void RecordPassthrough(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo);
+        /// @brief Optional companion stage, built on first use rather than in Init() so disabled features cost neither memory nor shader compilation
+        struct LazyStage
+        {
+            std::future<void> Future;
+            bool              Started = false;
+            bool              Ready   = false;
+        };
+        /// @brief Starts building stage on the first call, through the async path if async init is enabled. Returns true once the stage can record.
+        template <typename TStage>
+        bool PollLazyStage(TStage& stage, LazyStage& state);
+        /// @brief Waits for a pending build and resets state, so the stage can be destroyed
+        void ResetLazyStage(LazyStage& state);
+
+        /// @brief Records the NRD dispatch list, feeding motion as IN_MV
+        void RecordFullPass(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, core::ManagedImage* motion);
+        /// @brief Derives the denoising range from the scene depth measured by the tile classification pass
+        void UpdateDenoisingRange(base::FrameRenderInfo& renderInfo);
+        /// @brief Copies background pixels from PrimaryInput to PrimaryOutput, if background classification is enabled
+        void RecordBackgroundClassification(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo);
+
         static VkFormat sTranslateFormat(nrd::Format format);
 
         nrd::LibraryDesc    mLibraryDescription  = {};
@@ -61,10 +183,38 @@ namespace foray::nrdd {
 
         std::vector<Sampler> mSamplers;
 
+        core::SamplerReference mLinearClampSampler;
+
+        /// @brief Referenced by pImmutableSamplers of the cached descriptor set layouts. Not modified after InitSamplers().
+        std::vector<VkSampler> mImmutableSamplers;
+
+        std::map<LayoutKey, std::unique_ptr<LayoutCacheEntry>> mLayoutCache;
+
         std::unordered_map<nrd::ResourceType, core::ManagedImage*> mImageLookup;
 
         VkDescriptorPool mDescriptorPool = nullptr;
 
         bool mFirstFrameRendered = false;
+
+        bool                                      mAsyncInit = false;
+        std::future<void>                         mInitFuture;
+        std::atomic<bool>                         mReady = false;
+        std::chrono::steady_clock::time_point     mInitStart;
+        std::chrono::duration<double, std::milli> mTimeToReady = {};
+
+        NrdReprojectStage mReprojectStage;
+        LazyStage         mReprojectStageInit;
+        uint32_t          mFullPassInterval              = 1U;
+        fp32              mDisocclusionFallbackThreshold = 0.1f;
+        fp32              mDisocclusionDepthThreshold    = 0.05f;
+        uint32_t          mFramesSinceFullPass           = 0U;
+        bool              mLastFrameWasFullPass          = true;
+
+        NrdTileClassifyStage mTileClassifyStage;
+        LazyStage            mTileClassifyStageInit;
+        bool                 mBackgroundClassification = false;
+        fp32                 mBackgroundViewZ          = nrd::CommonSettings{}.denoisingRange;
+        /// @brief Headroom on top of the measured scene depth, as the measurement lags a few frames behind
+        fp32 mDenoisingRangeMargin = 1.05f;
     };
 }  // namespace foray::nrdd
@@ -0,0 +1,86 @@
+#include "foray_nrd_readback.hpp"
+
+namespace foray::nrdd {
+    void NrdReadbackBuffer::Create(core::Context* context, VkDeviceSize slotSize, std::string_view name)
+    {
+        Destroy();
+        mContext  = context;
+        mSlotSize = slotSize;
+
+        VkBufferUsageFlags usage = VkBufferUsageFlagBits::VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VkBufferUsageFlagBits::VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+        // Random host access favours cached memory, which may not be coherent (see Readback())
+        core::ManagedBuffer::CreateInfo ci(usage, mSlotSize * INFLIGHT_FRAME_COUNT, VmaMemoryUsage::VMA_MEMORY_USAGE_AUTO_PREFER_HOST,
+                                           VmaAllocationCreateFlagBits::VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT, std::string(name));
+        mBuffer.Create(mContext, ci);
+        void* data = nullptr;
+        mBuffer.Map(data);
+        mMapped = reinterpret_cast<uint8_t*>(data);
+    }
+    void NrdReadbackBuffer::CmdReset(VkCommandBuffer cmdBuffer, uint32_t slot)
+    {
+        vkCmdFillBuffer(cmdBuffer, mBuffer.GetBuffer(), mSlotSize * slot, mSlotSize, 0U);
+        mSlotPending[slot] = true;
+
+        VkBufferMemoryBarrier2 bufferBarrier{
+            .sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+            .srcAccessMask       = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .dstAccessMask       = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer              = mBuffer.GetBuffer(),
+            .offset              = mSlotSize * slot,
+            .size                = mSlotSize,
+        };
+
+        VkDependencyInfo depInfo{.sType                    = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                 .bufferMemoryBarrierCount = 1U,
+                                 .pBufferMemoryBarriers    = &bufferBarrier};
+
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+    }
+    void NrdReadbackBuffer::CmdPrepareForHostRead(VkCommandBuffer cmdBuffer, uint32_t slot)
+    {
+        VkBufferMemoryBarrier2 bufferBarrier{
+            .sType               = VkStructureType::VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .srcStageMask        = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            .srcAccessMask       = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            .dstStageMask        = VK_PIPELINE_STAGE_2_HOST_BIT,
+            .dstAccessMask       = VK_ACCESS_2_HOST_READ_BIT,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .buffer              = mBuffer.GetBuffer(),
+            .offset              = mSlotSize * slot,
+            .size                = mSlotSize,
+        };
+
+        VkDependencyInfo depInfo{.sType                    = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                 .bufferMemoryBarrierCount = 1U,
+                                 .pBufferMemoryBarriers    = &bufferBarrier};
+
+        vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+    }
+    const void* NrdReadbackBuffer::Readback(uint32_t slot)
+    {
+        if(!mSlotPending[slot])
+        {
+            return nullptr;
+        }
+        mSlotPending[slot] = false;
+        // The barrier only makes the writes available to the host domain, non-coherent memory additionally needs an invalidate (no-op on coherent memory)
+        AssertVkResult(vmaInvalidateAllocation(mContext->Allocator, mBuffer.GetAllocation(), mSlotSize * slot, mSlotSize));
+        return mMapped + mSlotSize * slot;
+    }
+    void NrdReadbackBuffer::Destroy()
+    {
+        if(!!mMapped)
+        {
+            mBuffer.Unmap();
+            mMapped = nullptr;
+        }
+        mBuffer.Destroy();
+        mSlotPending = {};
+    }
+}  // namespace foray::nrdd
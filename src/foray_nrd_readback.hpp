@@ -0,0 +1,43 @@
+#pragma once
+#include <array>
+#include <core/foray_context.hpp>
+#include <core/foray_managedbuffer.hpp>
+
+namespace foray::nrdd {
+
+    /// @brief Host visible buffer with one slot per in-flight frame, for small results the GPU writes and the host reads once the frame's fence has been waited on
+    class NrdReadbackBuffer
+    {
+      public:
+        void Create(core::Context* context, VkDeviceSize slotSize, std::string_view name);
+
+        /// @brief Zeroes the slot and makes that visible to subsequent compute shader writes. Marks the slot as pending readback.
+        void CmdReset(VkCommandBuffer cmdBuffer, uint32_t slot);
+        /// @brief Makes compute shader writes to the slot available to the host
+        void CmdPrepareForHostRead(VkCommandBuffer cmdBuffer, uint32_t slot);
+
+        /// @brief Returns the slot contents if it is pending readback, nullptr otherwise. Clears the pending state.
+        const void* Readback(uint32_t slot);
+        template <typename T>
+        inline const T* Readback(uint32_t slot)
+        {
+            return reinterpret_cast<const T*>(Readback(slot));
+        }
+        /// @brief Drops all pending readbacks, e.g. when their results no longer apply
+        inline void DiscardPending() { mSlotPending = {}; }
+
+        inline VkDescriptorBufferInfo GetVkDescriptorInfo() const { return VkDescriptorBufferInfo{.buffer = mBuffer.GetBuffer(), .offset = 0U, .range = VK_WHOLE_SIZE}; }
+
+        void Destroy();
+
+        inline virtual ~NrdReadbackBuffer() { Destroy(); }
+
+      protected:
+        core::Context*                         mContext = nullptr;
+        core::ManagedBuffer                    mBuffer;
+        uint8_t*                               mMapped      = nullptr;
+        VkDeviceSize                           mSlotSize    = 0;
+        std::array<bool, INFLIGHT_FRAME_COUNT> mSlotPending = {};
+    };
+
+}  // namespace foray::nrdd
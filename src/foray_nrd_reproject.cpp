@@ -0,0 +1,317 @@
+#include "foray_nrd_reproject.hpp"
+#include "foray_nrd.hpp"
+#include <nameof/nameof.hpp>
+
+namespace foray::nrdd {
+    // Must match the bindings declared in shaders/nrd_reproject.comp
+    constexpr uint32_t BIND_HISTORY             = 0U;
+    constexpr uint32_t BIND_HISTORY_VIEWZ       = 1U;
+    constexpr uint32_t BIND_MOTION              = 2U;
+    constexpr uint32_t BIND_VIEWZ               = 3U;
+    constexpr uint32_t BIND_INPUT               = 4U;
+    constexpr uint32_t BIND_ACCUM_MOTION_PREV   = 5U;
+    constexpr uint32_t BIND_HISTORY_OUT         = 6U;
+    constexpr uint32_t BIND_HISTORY_VIEWZ_OUT   = 7U;
+    constexpr uint32_t BIND_ACCUM_MOTION_OUT    = 8U;
+    constexpr uint32_t BIND_OUTPUT              = 9U;
+    constexpr uint32_t BIND_DISOCCLUSION_COUNTS = 10U;
+    constexpr uint32_t BIND_OUTPUT_SAMPLED      = 11U;
+    constexpr uint32_t SAMPLED_BINDING_COUNT    = 6U;
+    constexpr uint32_t STORAGE_BINDING_COUNT    = 4U;
+    constexpr uint32_t LOCAL_SIZE               = 16U;
+
+    void NrdReprojectStage::InitShader(NrdDenoiser* nrdDenoiser)
+    {
+        Destroy();
+        mContext     = nrdDenoiser->mContext;
+        mNrdDenoiser = nrdDenoiser;
+
+        mShader.LoadFromSource(mContext, NRD_SHADER_DIR "/nrd_reproject.comp");
+    }
+    void NrdReprojectStage::Init()
+    {
+        InitImages();
+        CreateDescriptorSetLayout();
+        CreatePipelineLayout();
+        CreatePipeline();
+    }
+    void NrdReprojectStage::InitImages()
+    {
+        core::ManagedImage* output = mNrdDenoiser->mImageLookup.at(nrd::ResourceType::OUT_DIFF_RADIANCE_HITDIST);
+        VkExtent3D          extent = output->GetExtent3D();
+        VkExtent2D          size{extent.width, extent.height};
+
+        VkImageUsageFlags usage = VkImageUsageFlagBits::VK_IMAGE_USAGE_SAMPLED_BIT | VkImageUsageFlagBits::VK_IMAGE_USAGE_STORAGE_BIT;
+
+        {
+            core::ManagedImage::CreateInfo ci(usage, output->GetFormat(), size, "NRD Reprojection History");
+            mHistory.Create(mContext, ci);
+        }
+        {
+            core::ManagedImage::CreateInfo ci(usage, VkFormat::VK_FORMAT_R32_SFLOAT, size, "NRD Reprojection History ViewZ");
+            mHistoryViewZ.Create(mContext, ci);
+        }
+        for(int32_t i = 0; i < mAccumulatedMotion.size(); i++)
+        {
+            core::ManagedImage::CreateInfo ci(usage, VkFormat::VK_FORMAT_R32G32_SFLOAT, size, fmt::format("NRD Accumulated Motion #{}", i));
+            mAccumulatedMotion[i].Create(mContext, ci);
+        }
+        mDisocclusionCounts.Create(mContext, sizeof(uint32_t), "NRD Disocclusion Counts");
+    }
+    void NrdReprojectStage::CreateDescriptorSetLayout()
+    {
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+
+        for(uint32_t i = 0; i < SAMPLED_BINDING_COUNT; i++)
+        {
+            bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = BIND_HISTORY + i,
+                                                            .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                                            .descriptorCount = 1U,
+                                                            .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
+        }
+        for(uint32_t i = 0; i < STORAGE_BINDING_COUNT; i++)
+        {
+            bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = BIND_HISTORY_OUT + i,
+                                                            .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                                            .descriptorCount = 1U,
+                                                            .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
+        }
+        bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = BIND_DISOCCLUSION_COUNTS,
+                                                        .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                        .descriptorCount = 1U,
+                                                        .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
+        // Capture reads the output through a sampler, as loading from a storage image of unknown format needs shaderStorageImageReadWithoutFormat
+        bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = BIND_OUTPUT_SAMPLED,
+                                                        .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                                        .descriptorCount = 1U,
+                                                        .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
+
+        VkDescriptorSetLayoutCreateInfo layoutCi{.sType        = VkStructureType::VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                                                 .flags        = VkDescriptorSetLayoutCreateFlagBits::VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR,
+                                                 .bindingCount = (uint32_t)bindings.size(),
+                                                 .pBindings    = bindings.data()};
+
+        AssertVkResult(vkCreateDescriptorSetLayout(mContext->Device(), &layoutCi, nullptr, &mDescriptorSetLayout));
+    }
+    void NrdReprojectStage::CreatePipelineLayout()
+    {
+        mPipelineLayout.AddDescriptorSetLayout(mDescriptorSetLayout);
+        mPipelineLayout.AddPushConstantRange<PushConstant>(VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT);
+        mPipelineLayout.Build(mContext);
+    }
+    void NrdReprojectStage::CreatePipeline()
+    {
+        VkComputePipelineCreateInfo pipelineCi{
+            .sType  = VkStructureType::VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage  = VkPipelineShaderStageCreateInfo{.sType  = VkStructureType::VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                                                      .stage  = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT,
+                                                      .module = mShader,
+                                                      .pName  = "main"},
+            .layout = mPipelineLayout,
+        };
+
+        AssertVkResult(vkCreateComputePipelines(mContext->Device(), nullptr, 1U, &pipelineCi, nullptr, &mPipeline));
+    }
+
+    void NrdReprojectStage::ReadbackDisocclusion(base::FrameRenderInfo& renderInfo)
+    {
+        uint32_t        slot  = renderInfo.GetFrameNumber() % INFLIGHT_FRAME_COUNT;
+        const uint32_t* count = mDisocclusionCounts.Readback<uint32_t>(slot);
+        if(!count)
+        {
+            return;
+        }
+        VkExtent3D extent    = mHistory.GetExtent3D();
+        mDisoccludedFraction = (fp32)*count / (fp32)(extent.width * extent.height);
+    }
+
+    void NrdReprojectStage::ResetHistory()
+    {
+        mHasHistory    = false;
+        mImagesWritten = false;
+        mDisocclusionCounts.DiscardPending();
+        mDisoccludedFraction = 0.f;
+    }
+
+    void NrdReprojectStage::RecordAccumulate(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, bool resetAccumulation)
+    {
+        RecordPass(cmdBuffer, renderInfo, EMode::Accumulate, resetAccumulation, 0.f);
+    }
+    void NrdReprojectStage::RecordCapture(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo)
+    {
+        RecordPass(cmdBuffer, renderInfo, EMode::Capture, false, 0.f);
+        mHasHistory = true;
+        // Measurements taken against the previous history no longer apply, including those of frames still in flight
+        mDisocclusionCounts.DiscardPending();
+        mDisoccludedFraction = 0.f;
+    }
+    void NrdReprojectStage::RecordReproject(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, bool resetAccumulation, fp32 depthThreshold)
+    {
+        Assert(mHasHistory, "Reprojection requires a previous full pass");
+        RecordPass(cmdBuffer, renderInfo, EMode::Reproject, resetAccumulation, depthThreshold);
+    }
+
+    void NrdReprojectStage::RecordPass(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, EMode mode, bool resetAccumulation, fp32 depthThreshold)
+    {
+        uint32_t slot = renderInfo.GetFrameNumber() % INFLIGHT_FRAME_COUNT;
+
+        // Capture leaves the accumulated motion untouched, the other modes ping-pong
+        uint32_t prevMotionIdx = mAccumulatedMotionIdx;
+        uint32_t curMotionIdx  = mode == EMode::Capture ? prevMotionIdx : (prevMotionIdx + 1) % mAccumulatedMotion.size();
+
+        const std::unordered_map<nrd::ResourceType, core::ManagedImage*>& lookup = mNrdDenoiser->mImageLookup;
+
+        core::ManagedImage* motion = lookup.at(nrd::ResourceType::IN_MV);
+        core::ManagedImage* viewZ  = lookup.at(nrd::ResourceType::IN_VIEWZ);
+        core::ManagedImage* input  = lookup.at(nrd::ResourceType::IN_DIFF_RADIANCE_HITDIST);
+        core::ManagedImage* output = lookup.at(nrd::ResourceType::OUT_DIFF_RADIANCE_HITDIST);
+
+        {  // Bind pipeline
+            vkCmdBindPipeline(cmdBuffer, VkPipelineBindPoint::VK_PIPELINE_BIND_POINT_COMPUTE, mPipeline);
+        }
+
+        if(mode == EMode::Reproject)
+        {  // Reset disocclusion counter
+            mDisocclusionCounts.CmdReset(cmdBuffer, slot);
+        }
+
+        if(mImagesWritten && mLayoutsRegisteredFrame != renderInfo.GetFrameNumber())
+        {  // The layout cache starts empty every frame, re-register the images which carry state across frames
+            for(core::ManagedImage* image : {&mHistory, &mHistoryViewZ, &mAccumulatedMotion[0], &mAccumulatedMotion[1]})
+            {
+                renderInfo.GetImageLayoutCache().Set(*image, VkImageLayout::VK_IMAGE_LAYOUT_GENERAL);
+            }
+            mLayoutsRegisteredFrame = renderInfo.GetFrameNumber();
+        }
+
+        std::vector<VkImageMemoryBarrier2> imageBarriers;
+        {  // Pipeline Barrier
+            core::ImageLayoutCache::Barrier2 readBarrier{.SrcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                                         .SrcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                         .DstStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                                         .DstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT,
+                                                         .NewLayout     = VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+            // Images owned by this stage and the output stay in general layout, so they can be bound as sampled and storage images alike
+            core::ImageLayoutCache::Barrier2 generalBarrier{.SrcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                                            .SrcAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                            .DstStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                                            .DstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                            .NewLayout     = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL};
+
+            for(core::ManagedImage* image : {motion, viewZ, input})
+            {
+                imageBarriers.push_back(renderInfo.GetImageLayoutCache().MakeBarrier(image->GetImage(), readBarrier));
+            }
+            for(core::ManagedImage* image : {&mHistory, &mHistoryViewZ, &mAccumulatedMotion[0], &mAccumulatedMotion[1], output})
+            {
+                imageBarriers.push_back(renderInfo.GetImageLayoutCache().MakeBarrier(image->GetImage(), generalBarrier));
+            }
+
+            VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                     .imageMemoryBarrierCount = (uint32_t)imageBarriers.size(),
+                                     .pImageMemoryBarriers    = imageBarriers.data()};
+
+            vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+        }
+        {  // Update Descriptor Set
+            VkSampler sampler = mNrdDenoiser->mLinearClampSampler;
+
+            std::array<VkDescriptorImageInfo, SAMPLED_BINDING_COUNT + STORAGE_BINDING_COUNT> imageInfos({
+                VkDescriptorImageInfo{sampler, mHistory.GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL},
+                VkDescriptorImageInfo{sampler, mHistoryViewZ.GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL},
+                VkDescriptorImageInfo{sampler, motion->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+                VkDescriptorImageInfo{sampler, viewZ->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+                VkDescriptorImageInfo{sampler, input->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+                VkDescriptorImageInfo{sampler, mAccumulatedMotion[prevMotionIdx].GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL},
+                VkDescriptorImageInfo{nullptr, mHistory.GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL},
+                VkDescriptorImageInfo{nullptr, mHistoryViewZ.GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL},
+                VkDescriptorImageInfo{nullptr, mAccumulatedMotion[curMotionIdx].GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL},
+                VkDescriptorImageInfo{nullptr, output->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL},
+            });
+
+            std::vector<VkWriteDescriptorSet> descriptorWrites;
+            for(uint32_t i = 0; i < imageInfos.size(); i++)
+            {
+                descriptorWrites.push_back(VkWriteDescriptorSet{
+                    .sType           = VkStructureType::VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                    .dstSet          = nullptr,
+                    .dstBinding      = BIND_HISTORY + i,
+                    .dstArrayElement = 0U,
+                    .descriptorCount = 1U,
+                    .descriptorType  = i < SAMPLED_BINDING_COUNT ? VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER : VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                    .pImageInfo      = &imageInfos[i],
+                });
+            }
+
+            VkDescriptorBufferInfo bufInfo = mDisocclusionCounts.GetVkDescriptorInfo();
+            descriptorWrites.push_back(VkWriteDescriptorSet{
+                .sType           = VkStructureType::VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = nullptr,
+                .dstBinding      = BIND_DISOCCLUSION_COUNTS,
+                .descriptorCount = 1u,
+                .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pImageInfo      = nullptr,
+                .pBufferInfo     = &bufInfo,
+            });
+
+            VkDescriptorImageInfo outputSampledInfo{sampler, output->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL};
+            descriptorWrites.push_back(VkWriteDescriptorSet{
+                .sType           = VkStructureType::VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet          = nullptr,
+                .dstBinding      = BIND_OUTPUT_SAMPLED,
+                .descriptorCount = 1u,
+                .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                .pImageInfo      = &outputSampledInfo,
+            });
+
+            mContext->VkbDispatchTable->cmdPushDescriptorSetKHR(cmdBuffer, VkPipelineBindPoint::VK_PIPELINE_BIND_POINT_COMPUTE, mPipelineLayout, 0, descriptorWrites.size(),
+                                                                descriptorWrites.data());
+        }
+        {  // Push Constants
+            PushConstant pushC{
+                .Mode              = (uint32_t)mode,
+                .ResetAccumulation = resetAccumulation ? 1U : 0U,
+                .DepthThreshold    = depthThreshold,
+                .DisocclusionSlot  = slot,
+            };
+            vkCmdPushConstants(cmdBuffer, mPipelineLayout, VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT, 0U, sizeof(pushC), &pushC);
+        }
+        {  // Dispatch
+            VkExtent3D extent = mHistory.GetExtent3D();
+            vkCmdDispatch(cmdBuffer, (extent.width + LOCAL_SIZE - 1) / LOCAL_SIZE, (extent.height + LOCAL_SIZE - 1) / LOCAL_SIZE, 1U);
+        }
+        if(mode == EMode::Reproject)
+        {
+            mDisocclusionCounts.CmdPrepareForHostRead(cmdBuffer, slot);
+        }
+
+        mAccumulatedMotionIdx = curMotionIdx;
+        mImagesWritten        = true;
+    }
+    void NrdReprojectStage::Destroy()
+    {
+        if(!!mPipeline)
+        {
+            vkDestroyPipeline(mContext->Device(), mPipeline, nullptr);
+            mPipeline = nullptr;
+        }
+        mShader.Destroy();
+        mPipelineLayout.Destroy();
+        if(!!mDescriptorSetLayout)
+        {
+            vkDestroyDescriptorSetLayout(mContext->Device(), mDescriptorSetLayout, nullptr);
+            mDescriptorSetLayout = nullptr;
+        }
+        mDisocclusionCounts.Destroy();
+        mHistory.Destroy();
+        mHistoryViewZ.Destroy();
+        for(core::ManagedImage& image : mAccumulatedMotion)
+        {
+            image.Destroy();
+        }
+        mAccumulatedMotionIdx   = 0;
+        mLayoutsRegisteredFrame = ~0ULL;
+        ResetHistory();
+    }
+
+}  // namespace foray::nrdd
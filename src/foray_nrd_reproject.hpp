@@ -0,0 +1,88 @@
+#pragma once
+#include "foray_nrd_readback.hpp"
+#include "include_ndr.hpp"
+#include <array>
+#include <core/foray_managedimage.hpp>
+#include <core/foray_shadermodule.hpp>
+#include <stages/foray_renderstage.hpp>
+#include <util/foray_pipelinelayout.hpp>
+
+namespace foray::nrdd {
+    class NrdDenoiser;
+
+    /// @brief Lightweight stand-in for the NRD dispatch list on reduced-rate frames.
+    /// Warps the output of the last full pass along accumulated motion vectors and detects disocclusion via view depth.
+    class NrdReprojectStage : public stages::RenderStage
+    {
+      public:
+        /// @brief Compiles and loads the shader. Shader compilation goes through the context, so this runs on the calling thread of NrdDenoiser::Init.
+        void InitShader(NrdDenoiser* nrdDenoiser);
+        /// @brief Creates images, buffers and the pipeline. Requires InitShader(), may run on the async init worker.
+        void Init();
+
+        /// @brief Reads back the disocclusion count written by the frame which previously used this in-flight slot
+        void ReadbackDisocclusion(base::FrameRenderInfo& renderInfo);
+
+        /// @brief Full pass frame, before NRD: accumulates motion vectors since the last full pass and stores view depth for the next reprojection
+        void RecordAccumulate(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, bool resetAccumulation);
+        /// @brief Full pass frame, after NRD: copies the denoised output into the reprojection history
+        void RecordCapture(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo);
+        /// @brief Reduced-rate frame: writes the reprojected history to the output. Disoccluded pixels fall back to the noisy input.
+        void RecordReproject(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, bool resetAccumulation, fp32 depthThreshold);
+
+        /// @brief Motion vectors from the current frame back to the frame of the last full pass (as written by the last Record call)
+        inline core::ManagedImage* GetAccumulatedMotion() { return &mAccumulatedMotion[mAccumulatedMotionIdx]; }
+        inline bool                HasHistory() const { return mHasHistory; }
+        /// @brief Invalidates the history and pending disocclusion measurements, so the next reduced-rate frame has to run a full pass first
+        void ResetHistory();
+        /// @brief Fraction of disoccluded pixels of the last reprojected frame which has completed on the GPU
+        inline fp32 GetDisoccludedFraction() const { return mDisoccludedFraction; }
+
+        virtual void Destroy() override;
+
+        inline virtual ~NrdReprojectStage() { Destroy(); }
+
+      protected:
+        enum class EMode : uint32_t
+        {
+            Accumulate = 0,
+            Capture    = 1,
+            Reproject  = 2,
+        };
+
+        struct PushConstant
+        {
+            uint32_t Mode              = 0;
+            uint32_t ResetAccumulation = 0;
+            fp32     DepthThreshold    = 0.f;
+            uint32_t DisocclusionSlot  = 0;
+        };
+
+        NrdDenoiser* mNrdDenoiser = nullptr;
+
+        core::ShaderModule    mShader;
+        VkDescriptorSetLayout mDescriptorSetLayout = nullptr;
+        util::PipelineLayout  mPipelineLayout;
+        VkPipeline            mPipeline = nullptr;
+
+        core::ManagedImage                mHistory;
+        core::ManagedImage                mHistoryViewZ;
+        std::array<core::ManagedImage, 2> mAccumulatedMotion;
+        uint32_t                          mAccumulatedMotionIdx = 0;
+        bool                              mHasHistory           = false;
+        /// @brief Set once the images above hold state, which has to survive into the next frame (see RecordPass())
+        bool     mImagesWritten          = false;
+        uint64_t mLayoutsRegisteredFrame = ~0ULL;
+
+        NrdReadbackBuffer mDisocclusionCounts;
+        fp32              mDisoccludedFraction = 0.f;
+
+        void InitImages();
+        void CreateDescriptorSetLayout();
+        void CreatePipelineLayout();
+        void CreatePipeline();
+
+        void RecordPass(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, EMode mode, bool resetAccumulation, fp32 depthThreshold);
+    };
+
+}  // namespace foray::nrdd
@@ -19,8 +19,7 @@ namespace foray::nrdd {
         }
 
         InitShader();
-        CreateDescriptorSet();
-        CreatePipelineLayout();
+        mPipelineLayout = mNrdDenoiser->GetOrCreateLayout(mPipelineDesc).PipelineLayout;
 
 
         VkComputePipelineCreateInfo pipelineCi{
@@ -39,84 +38,6 @@ namespace foray::nrdd {
         const nrd::ComputeShader& shader = mPipelineDesc.computeShaderSPIRV;
         mShader.LoadFromBinary(mContext, reinterpret_cast<const uint32_t*>(shader.bytecode), shader.size);
     }
-    void NrdSubStage::CreateDescriptorSet()
-    {
-        std::vector<VkDescriptorSetLayoutBinding> bindings;
-
-        std::vector<VkSampler> samplers;
-        samplers.reserve(mNrdDenoiser->mSamplers.size());
-
-        uint32_t offset = NrdDenoiser::BIND_OFFSET_SAMPLERS;
-        for(const NrdDenoiser::Sampler& sampler : mNrdDenoiser->mSamplers)
-        {
-            samplers.push_back(sampler.Ref);
-            bindings.push_back(VkDescriptorSetLayoutBinding{.binding            = offset,
-                                                            .descriptorType     = VkDescriptorType::VK_DESCRIPTOR_TYPE_SAMPLER,
-                                                            .descriptorCount    = 1U,
-                                                            .stageFlags         = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT,
-                                                            .pImmutableSamplers = &samplers.back()});
-            offset++;
-        }
-
-
-        if(mPipelineDesc.hasConstantData)
-        {
-            bindings.push_back(VkDescriptorSetLayoutBinding{.binding         = NrdDenoiser::BIND_OFFSET_CONSTANTBUF,
-                                                            .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-                                                            .descriptorCount = 1U,
-                                                            .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT});
-        }
-
-        uint32_t offsetStorage = NrdDenoiser::BIND_OFFSET_STORAGEIMG;
-        uint32_t offsetReadTex = NrdDenoiser::BIND_OFFSET_TEXIMG;
-        for(int32_t i = 0; i < mPipelineDesc.descriptorRangeNum; i++)
-        {
-            const nrd::DescriptorRangeDesc& desc = mPipelineDesc.descriptorRanges[i];
-            VkDescriptorType                type;
-            uint32_t*                       offset     = nullptr;
-            VkSampler*                      samplerArr = nullptr;
-            switch(desc.descriptorType)
-            {
-                case nrd::DescriptorType::TEXTURE:
-                    type       = VkDescriptorType::VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
-                    offset     = &offsetReadTex;
-                    samplerArr = &samplers[desc.baseRegisterIndex];
-                    break;
-                case nrd::DescriptorType::STORAGE_TEXTURE:
-                    type   = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-                    offset = &offsetStorage;
-                    break;
-                default:
-                    Exception::Throw("Unhandled DescriptorType Enum Value");
-            }
-
-            const nrd::DescriptorRangeDesc& range = mPipelineDesc.descriptorRanges[i];
-            for(int32_t j = 0; j < range.descriptorNum; j++)
-            {
-                // logger()->info("Layout [{}/{}] (baseReg {}) {} to {}", j, desc.descriptorNum, desc.baseRegisterIndex, NAMEOF_ENUM(desc.descriptorType), *offset);
-
-                bindings.push_back(VkDescriptorSetLayoutBinding{.binding            = *offset,
-                                                                .descriptorType     = type,
-                                                                .descriptorCount    = 1U,
-                                                                .stageFlags         = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT,
-                                                                .pImmutableSamplers = samplerArr});
-                *offset = *offset + 1;
-            }
-
-        }
-
-        VkDescriptorSetLayoutCreateInfo layoutCi{.sType        = VkStructureType::VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-                                                 .flags        = VkDescriptorSetLayoutCreateFlagBits::VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR,
-                                                 .bindingCount = (uint32_t)bindings.size(),
-                                                 .pBindings    = bindings.data()};
-
-        AssertVkResult(vkCreateDescriptorSetLayout(mContext->Device(), &layoutCi, nullptr, &mDescriptorSetLayout));
-    }
-    void NrdSubStage::CreatePipelineLayout()
-    {
-        mPipelineLayout.AddDescriptorSetLayout(mDescriptorSetLayout);
-        mPipelineLayout.Build(mContext);
-    }
 
     void NrdSubStage::RecordFrame(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, const nrd::DispatchDesc& desc)
     {
@@ -251,12 +172,7 @@ namespace foray::nrdd {
             mPipeline = nullptr;
         }
         mShader.Destroy();
-        mPipelineLayout.Destroy();
-        if(!!mDescriptorSetLayout)
-        {
-            vkDestroyDescriptorSetLayout(mContext->Device(), mDescriptorSetLayout, nullptr);
-            mDescriptorSetLayout = nullptr;
-        }
+        mPipelineLayout = nullptr;
         mConstantsBuffer.Destroy();
     }
 
@@ -2,7 +2,6 @@
 #include "include_ndr.hpp"
 #include <core/foray_shadermodule.hpp>
 #include <stages/foray_renderstage.hpp>
-#include <util/foray_pipelinelayout.hpp>
 #include <util/foray_dualbuffer.hpp>
 
 namespace foray::nrdd {
@@ -23,16 +22,14 @@ namespace foray::nrdd {
         NrdDenoiser*      mNrdDenoiser  = nullptr;
         nrd::PipelineDesc mPipelineDesc = {};
 
-        core::ShaderModule    mShader;
-        VkDescriptorSetLayout mDescriptorSetLayout = nullptr;
-        util::PipelineLayout  mPipelineLayout;
-        VkPipeline            mPipeline = nullptr;
+        core::ShaderModule mShader;
+        /// @brief Shared with other substages of the same binding signature, owned by the layout cache of NrdDenoiser
+        VkPipelineLayout mPipelineLayout = nullptr;
+        VkPipeline       mPipeline       = nullptr;
 
         util::DualBuffer mConstantsBuffer;
 
         void InitShader();
-        void CreateDescriptorSet();
-        void CreatePipelineLayout();
     };
 
 }  // namespace foray::nrdd
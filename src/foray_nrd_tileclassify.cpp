@@ -0,0 +1,204 @@
+#include "foray_nrd_tileclassify.hpp"
+#include "foray_nrd.hpp"
+#include <bit>
+
+namespace foray::nrdd {
+    // Must match the bindings declared in shaders/nrd_tileclassify.comp
+    constexpr uint32_t BIND_VIEWZ   = 0U;
+    constexpr uint32_t BIND_INPUT   = 1U;
+    constexpr uint32_t BIND_OUTPUT  = 2U;
+    constexpr uint32_t BIND_RESULTS = 3U;
+
+    void NrdTileClassifyStage::InitShader(NrdDenoiser* nrdDenoiser)
+    {
+        Destroy();
+        mContext     = nrdDenoiser->mContext;
+        mNrdDenoiser = nrdDenoiser;
+
+        mShader.LoadFromSource(mContext, NRD_SHADER_DIR "/nrd_tileclassify.comp");
+    }
+    void NrdTileClassifyStage::Init()
+    {
+        mResults.Create(mContext, sizeof(Results), "NRD Tile Classification Results");
+        CreateDescriptorSetLayout();
+        CreatePipelineLayout();
+        CreatePipeline();
+    }
+    void NrdTileClassifyStage::CreateDescriptorSetLayout()
+    {
+        std::array<VkDescriptorSetLayoutBinding, 4> bindings({
+            VkDescriptorSetLayoutBinding{.binding         = BIND_VIEWZ,
+                                         .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                         .descriptorCount = 1U,
+                                         .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT},
+            VkDescriptorSetLayoutBinding{.binding         = BIND_INPUT,
+                                         .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                         .descriptorCount = 1U,
+                                         .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT},
+            VkDescriptorSetLayoutBinding{.binding         = BIND_OUTPUT,
+                                         .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                         .descriptorCount = 1U,
+                                         .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT},
+            VkDescriptorSetLayoutBinding{.binding         = BIND_RESULTS,
+                                         .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                         .descriptorCount = 1U,
+                                         .stageFlags      = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT},
+        });
+
+        VkDescriptorSetLayoutCreateInfo layoutCi{.sType        = VkStructureType::VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                                                 .flags        = VkDescriptorSetLayoutCreateFlagBits::VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR,
+                                                 .bindingCount = (uint32_t)bindings.size(),
+                                                 .pBindings    = bindings.data()};
+
+        AssertVkResult(vkCreateDescriptorSetLayout(mContext->Device(), &layoutCi, nullptr, &mDescriptorSetLayout));
+    }
+    void NrdTileClassifyStage::CreatePipelineLayout()
+    {
+        mPipelineLayout.AddDescriptorSetLayout(mDescriptorSetLayout);
+        mPipelineLayout.AddPushConstantRange<PushConstant>(VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT);
+        mPipelineLayout.Build(mContext);
+    }
+    void NrdTileClassifyStage::CreatePipeline()
+    {
+        VkComputePipelineCreateInfo pipelineCi{
+            .sType  = VkStructureType::VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage  = VkPipelineShaderStageCreateInfo{.sType  = VkStructureType::VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                                                      .stage  = VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT,
+                                                      .module = mShader,
+                                                      .pName  = "main"},
+            .layout = mPipelineLayout,
+        };
+
+        AssertVkResult(vkCreateComputePipelines(mContext->Device(), nullptr, 1U, &pipelineCi, nullptr, &mPipeline));
+    }
+
+    VkExtent2D NrdTileClassifyStage::GetTileCount()
+    {
+        VkExtent3D extent = mNrdDenoiser->mImageLookup.at(nrd::ResourceType::OUT_DIFF_RADIANCE_HITDIST)->GetExtent3D();
+        return VkExtent2D{(extent.width + TILE_SIZE - 1) / TILE_SIZE, (extent.height + TILE_SIZE - 1) / TILE_SIZE};
+    }
+
+    bool NrdTileClassifyStage::ReadbackResults(base::FrameRenderInfo& renderInfo)
+    {
+        uint32_t       slot    = renderInfo.GetFrameNumber() % INFLIGHT_FRAME_COUNT;
+        const Results* results = mResults.Readback<Results>(slot);
+        if(!results)
+        {
+            return false;
+        }
+        VkExtent2D tiles        = GetTileCount();
+        mBackgroundTileFraction = (fp32)results->BackgroundTiles / (fp32)(tiles.width * tiles.height);
+        mMaxForegroundViewZ     = std::bit_cast<fp32>(results->MaxForegroundViewZ);
+        return true;
+    }
+
+    void NrdTileClassifyStage::RecordFrame(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, fp32 denoisingRange, fp32 backgroundViewZ)
+    {
+        uint32_t slot = renderInfo.GetFrameNumber() % INFLIGHT_FRAME_COUNT;
+
+        const std::unordered_map<nrd::ResourceType, core::ManagedImage*>& lookup = mNrdDenoiser->mImageLookup;
+
+        core::ManagedImage* viewZ  = lookup.at(nrd::ResourceType::IN_VIEWZ);
+        core::ManagedImage* input  = lookup.at(nrd::ResourceType::IN_DIFF_RADIANCE_HITDIST);
+        core::ManagedImage* output = lookup.at(nrd::ResourceType::OUT_DIFF_RADIANCE_HITDIST);
+
+        {  // Bind pipeline
+            vkCmdBindPipeline(cmdBuffer, VkPipelineBindPoint::VK_PIPELINE_BIND_POINT_COMPUTE, mPipeline);
+        }
+        {  // Reset results
+            mResults.CmdReset(cmdBuffer, slot);
+        }
+        {  // Pipeline Barrier
+            std::array<VkImageMemoryBarrier2, 3> imageBarriers;
+
+            core::ImageLayoutCache::Barrier2 readBarrier{.SrcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                                         .SrcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                         .DstStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                                         .DstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT,
+                                                         .NewLayout     = VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+            imageBarriers[0] = renderInfo.GetImageLayoutCache().MakeBarrier(viewZ->GetImage(), readBarrier);
+            imageBarriers[1] = renderInfo.GetImageLayoutCache().MakeBarrier(input->GetImage(), readBarrier);
+
+            core::ImageLayoutCache::Barrier2 writeBarrier{.SrcStageMask  = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                                                          .SrcAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                          .DstStageMask  = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                                          .DstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+                                                          .NewLayout     = VkImageLayout::VK_IMAGE_LAYOUT_GENERAL};
+            imageBarriers[2] = renderInfo.GetImageLayoutCache().MakeBarrier(output->GetImage(), writeBarrier);
+
+            VkDependencyInfo depInfo{.sType                   = VkStructureType::VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                                     .imageMemoryBarrierCount = (uint32_t)imageBarriers.size(),
+                                     .pImageMemoryBarriers    = imageBarriers.data()};
+
+            vkCmdPipelineBarrier2(cmdBuffer, &depInfo);
+        }
+        {  // Update Descriptor Set
+            VkSampler sampler = mNrdDenoiser->mLinearClampSampler;
+
+            VkDescriptorImageInfo  viewZInfo{sampler, viewZ->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+            VkDescriptorImageInfo  inputInfo{sampler, input->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+            VkDescriptorImageInfo  outputInfo{nullptr, output->GetImageView(), VkImageLayout::VK_IMAGE_LAYOUT_GENERAL};
+            VkDescriptorBufferInfo bufInfo = mResults.GetVkDescriptorInfo();
+
+            std::array<VkWriteDescriptorSet, 4> descriptorWrites({
+                VkWriteDescriptorSet{.sType           = VkStructureType::VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                     .dstBinding      = BIND_VIEWZ,
+                                     .descriptorCount = 1U,
+                                     .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                     .pImageInfo      = &viewZInfo},
+                VkWriteDescriptorSet{.sType           = VkStructureType::VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                     .dstBinding      = BIND_INPUT,
+                                     .descriptorCount = 1U,
+                                     .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+                                     .pImageInfo      = &inputInfo},
+                VkWriteDescriptorSet{.sType           = VkStructureType::VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                     .dstBinding      = BIND_OUTPUT,
+                                     .descriptorCount = 1U,
+                                     .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                                     .pImageInfo      = &outputInfo},
+                VkWriteDescriptorSet{.sType           = VkStructureType::VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                     .dstBinding      = BIND_RESULTS,
+                                     .descriptorCount = 1U,
+                                     .descriptorType  = VkDescriptorType::VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                     .pBufferInfo     = &bufInfo},
+            });
+
+            mContext->VkbDispatchTable->cmdPushDescriptorSetKHR(cmdBuffer, VkPipelineBindPoint::VK_PIPELINE_BIND_POINT_COMPUTE, mPipelineLayout, 0, descriptorWrites.size(),
+                                                                descriptorWrites.data());
+        }
+        {  // Push Constants
+            PushConstant pushC{
+                .DenoisingRange  = denoisingRange,
+                .BackgroundViewZ = backgroundViewZ,
+                .ResultSlot      = slot,
+            };
+            vkCmdPushConstants(cmdBuffer, mPipelineLayout, VkShaderStageFlagBits::VK_SHADER_STAGE_COMPUTE_BIT, 0U, sizeof(pushC), &pushC);
+        }
+        {  // Dispatch (one workgroup per tile)
+            VkExtent2D tiles = GetTileCount();
+            vkCmdDispatch(cmdBuffer, tiles.width, tiles.height, 1U);
+        }
+        {  // Results are read back by ReadbackResults()
+            mResults.CmdPrepareForHostRead(cmdBuffer, slot);
+        }
+    }
+    void NrdTileClassifyStage::Destroy()
+    {
+        if(!!mPipeline)
+        {
+            vkDestroyPipeline(mContext->Device(), mPipeline, nullptr);
+            mPipeline = nullptr;
+        }
+        mShader.Destroy();
+        mPipelineLayout.Destroy();
+        if(!!mDescriptorSetLayout)
+        {
+            vkDestroyDescriptorSetLayout(mContext->Device(), mDescriptorSetLayout, nullptr);
+            mDescriptorSetLayout = nullptr;
+        }
+        mResults.Destroy();
+        mBackgroundTileFraction = 0.f;
+        mMaxForegroundViewZ     = 0.f;
+    }
+
+}  // namespace foray::nrdd
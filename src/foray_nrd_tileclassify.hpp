@@ -0,0 +1,72 @@
+#pragma once
+#include "foray_nrd_readback.hpp"
+#include "include_ndr.hpp"
+#include <core/foray_shadermodule.hpp>
+#include <stages/foray_renderstage.hpp>
+#include <util/foray_pipelinelayout.hpp>
+
+namespace foray::nrdd {
+    class NrdDenoiser;
+
+    /// @brief Classifies 16x16 tiles of IN_VIEWZ as background (beyond the denoising range) and copies background pixels from the noisy input to the output.
+    /// Also measures the maximum foreground view depth, from which NrdDenoiser derives CommonSettings::denoisingRange.
+    class NrdTileClassifyStage : public stages::RenderStage
+    {
+      public:
+        inline static constexpr uint32_t TILE_SIZE = 16U;
+
+        /// @brief Compiles and loads the shader. Shader compilation goes through the context, so this runs on the calling thread of NrdDenoiser::Init.
+        void InitShader(NrdDenoiser* nrdDenoiser);
+        /// @brief Creates the results buffer and the pipeline. Requires InitShader(), may run on the async init worker.
+        void Init();
+
+        /// @brief Reads back the results written by the frame which previously used this in-flight slot. Returns false if there were none.
+        bool ReadbackResults(base::FrameRenderInfo& renderInfo);
+
+        /// @param denoisingRange Pixels with a view depth beyond this are background
+        /// @param backgroundViewZ Pixels with a view depth beyond this are excluded from the foreground depth measurement (sky)
+        void RecordFrame(VkCommandBuffer cmdBuffer, base::FrameRenderInfo& renderInfo, fp32 denoisingRange, fp32 backgroundViewZ);
+
+        /// @brief Fraction of tiles classified as background in the last completed frame
+        inline fp32 GetBackgroundTileFraction() const { return mBackgroundTileFraction; }
+        /// @brief Maximum view depth of foreground pixels in the last completed frame. Zero if there were none.
+        inline fp32 GetMaxForegroundViewZ() const { return mMaxForegroundViewZ; }
+
+        virtual void Destroy() override;
+
+        inline virtual ~NrdTileClassifyStage() { Destroy(); }
+
+      protected:
+        struct PushConstant
+        {
+            fp32     DenoisingRange  = 0.f;
+            fp32     BackgroundViewZ = 0.f;
+            uint32_t ResultSlot      = 0;
+        };
+
+        /// @brief Layout of one in-flight slot of the results buffer (must match shaders/nrd_tileclassify.comp)
+        struct Results
+        {
+            uint32_t BackgroundTiles    = 0;
+            uint32_t MaxForegroundViewZ = 0;  // fp32 bits, positive floats order like unsigned integers
+        };
+
+        NrdDenoiser* mNrdDenoiser = nullptr;
+
+        core::ShaderModule    mShader;
+        VkDescriptorSetLayout mDescriptorSetLayout = nullptr;
+        util::PipelineLayout  mPipelineLayout;
+        VkPipeline            mPipeline = nullptr;
+
+        NrdReadbackBuffer mResults;
+        fp32              mBackgroundTileFraction = 0.f;
+        fp32              mMaxForegroundViewZ     = 0.f;
+
+        void CreateDescriptorSetLayout();
+        void CreatePipelineLayout();
+        void CreatePipeline();
+
+        VkExtent2D GetTileCount();
+    };
+
+}  // namespace foray::nrdd